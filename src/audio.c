@@ -0,0 +1,507 @@
+#ifndef _3DS
+// clock_gettime() and CLOCK_MONOTONIC for host builds under -std=c99
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _3DS
+#include <3ds.h>
+#else
+#include <time.h>
+#endif
+
+#include "audio.h"
+
+#define AUDIO_JITTER_MIN_MS 40
+#define AUDIO_JITTER_MAX_MS 400
+#define AUDIO_JITTER_STEP_MS 20
+// Playback time without an underrun before the target is lowered again
+#define AUDIO_JITTER_DECAY_MS 5000
+// Sequence jumps larger than this, or a drop back to 0, are treated as a
+// restarted stream
+#define AUDIO_JITTER_RESYNC 64
+
+static struct audio_sink* audio_output;
+static struct audio_jitter audio_jb;
+static bool audio_active = false;
+// Set when the sink fails to open so every following packet doesn't retry
+static bool audio_failed = false;
+static bool audio_initialized = false;
+// Sink underrun count already folded into the jitter buffer stats
+static uint32_t audio_sink_underruns;
+static int16_t audio_samples[AUDIO_MAX_PACKET_FRAMES * AUDIO_MAX_CHANNELS];
+
+/*
+ * On the console a feeder thread, woken by the DSP frame callback, moves
+ * audio to the sink so playback doesn't depend on the main loop's timing.
+ * The lock guards the stream state shared with it. The host build has no
+ * feeder thread, so the lock is a no-op there.
+ */
+#ifdef _3DS
+static LightLock audio_mutex;
+static LightEvent audio_wake;
+static Thread audio_feeder;
+static volatile bool audio_feeding = false;
+
+static inline void audio_lock() {
+    LightLock_Lock(&audio_mutex);
+}
+
+static inline void audio_unlock() {
+    LightLock_Unlock(&audio_mutex);
+}
+#else
+static inline void audio_lock() {}
+static inline void audio_unlock() {}
+#endif
+
+static const int16_t adpcm_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+static const int8_t adpcm_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static inline uint16_t read_u16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t read_u32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t frames_to_ms(uint32_t frames, uint32_t sample_rate) {
+    return (uint64_t)frames * 1000 / sample_rate;
+}
+
+static inline uint32_t ms_to_frames(uint32_t ms, uint32_t sample_rate) {
+    return (uint64_t)ms * sample_rate / 1000;
+}
+
+// Return 0 if *data* holds a well-formed audio packet, -1 otherwise
+int audio_packet_parse(struct audio_packet* packet, const uint8_t* data, size_t size) {
+    if (size < AUDIO_PACKET_HEADER_SIZE || memcmp(data, AUDIO_PACKET_MAGIC, 4) != 0)
+        return -1;
+    if (data[4] != AUDIO_PACKET_VERSION)
+        return -1;
+
+    packet->codec       = data[5];
+    packet->channels    = data[6];
+    packet->sequence    = read_u32(data + 8);
+    packet->timestamp   = read_u32(data + 12);
+    packet->sample_rate = read_u32(data + 16);
+    packet->frames      = read_u16(data + 20);
+    packet->payload      = data + AUDIO_PACKET_HEADER_SIZE;
+    packet->payload_size = size - AUDIO_PACKET_HEADER_SIZE;
+
+    if (packet->channels == 0 || packet->channels > AUDIO_MAX_CHANNELS)
+        return -1;
+    if (packet->sample_rate < 8000 || packet->sample_rate > 48000)
+        return -1;
+    if (packet->frames == 0 || packet->frames > AUDIO_MAX_PACKET_FRAMES)
+        return -1;
+
+    size_t samples = (size_t)packet->frames * packet->channels;
+    if (packet->codec == AUDIO_CODEC_PCM16) {
+        if (packet->payload_size < samples * 2)
+            return -1;
+    } else if (packet->codec == AUDIO_CODEC_ADPCM) {
+        if (packet->payload_size < 4 * packet->channels + (samples + 1) / 2)
+            return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void adpcm_decode(const struct audio_packet* packet, int16_t* out) {
+    int predictor[AUDIO_MAX_CHANNELS], index[AUDIO_MAX_CHANNELS];
+    const uint8_t* p = packet->payload;
+    size_t i, samples = (size_t)packet->frames * packet->channels;
+    int c;
+
+    for (c = 0; c < packet->channels; ++c, p += 4) {
+        predictor[c] = (int16_t)read_u16(p);
+        index[c] = p[2] > 88 ? 88 : p[2];
+    }
+
+    for (i = 0; i < samples; ++i) {
+        int code = (i & 1) ? (p[i >> 1] >> 4) : (p[i >> 1] & 0x0F);
+        c = i % packet->channels;
+        int step = adpcm_step_table[index[c]];
+        int diff = step >> 3;
+        if (code & 1) diff += step >> 2;
+        if (code & 2) diff += step >> 1;
+        if (code & 4) diff += step;
+        if (code & 8)
+            predictor[c] -= diff;
+        else
+            predictor[c] += diff;
+        if (predictor[c] > 32767)
+            predictor[c] = 32767;
+        else if (predictor[c] < -32768)
+            predictor[c] = -32768;
+        index[c] += adpcm_index_table[code];
+        if (index[c] < 0)
+            index[c] = 0;
+        else if (index[c] > 88)
+            index[c] = 88;
+        out[i] = predictor[c];
+    }
+}
+
+/*
+ * Decodes *packet* into interleaved PCM16 samples.
+ * *out* must hold at least frames * channels samples.
+ */
+int audio_packet_decode(const struct audio_packet* packet, int16_t* out) {
+    size_t i, samples = (size_t)packet->frames * packet->channels;
+    if (packet->codec == AUDIO_CODEC_PCM16) {
+        for (i = 0; i < samples; ++i)
+            out[i] = (int16_t)read_u16(packet->payload + i * 2);
+    } else if (packet->codec == AUDIO_CODEC_ADPCM) {
+        adpcm_decode(packet, out);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void jitter_drop(struct audio_jitter* jb, uint32_t frames) {
+    if (frames > jb->count)
+        frames = jb->count;
+    jb->read_pos = (jb->read_pos + frames) % jb->capacity;
+    jb->count -= frames;
+}
+
+static void jitter_retarget(struct audio_jitter* jb) {
+    uint32_t target = jb->base_ms;
+    uint32_t jitter = 2 * (jb->jitter_q4 >> 4);
+    if (jitter > target)
+        target = jitter;
+    if (target < jb->min_ms)
+        target = jb->min_ms;
+    if (target > jb->max_ms)
+        target = jb->max_ms;
+    jb->target_ms = target;
+}
+
+static void jitter_underrun(struct audio_jitter* jb) {
+    jb->stats.underruns++;
+    jb->stable_frames = 0;
+    jb->base_ms += AUDIO_JITTER_STEP_MS;
+    if (jb->base_ms > jb->max_ms)
+        jb->base_ms = jb->max_ms;
+    jitter_retarget(jb);
+}
+
+// Return 0 on success, -1 if the ring buffer could not be allocated
+int audio_jitter_init(struct audio_jitter* jb, uint32_t sample_rate, uint8_t channels,
+                      uint32_t min_ms, uint32_t max_ms) {
+    memset(jb, 0, sizeof(*jb));
+    jb->sample_rate = sample_rate;
+    jb->channels    = channels;
+    jb->min_ms      = min_ms;
+    jb->max_ms      = max_ms;
+    jb->base_ms     = min_ms + AUDIO_JITTER_STEP_MS;
+    // Room for the highest trim threshold plus one full packet
+    jb->capacity = ms_to_frames(2 * max_ms + AUDIO_JITTER_STEP_MS, sample_rate) + AUDIO_MAX_PACKET_FRAMES;
+    jb->ring = malloc(jb->capacity * channels * sizeof(int16_t));
+    if (!jb->ring)
+        return -1;
+    jitter_retarget(jb);
+    return 0;
+}
+
+void audio_jitter_free(struct audio_jitter* jb) {
+    free(jb->ring);
+    jb->ring = NULL;
+}
+
+/*
+ * Queues *frames* decoded frames. Packets that arrive after a newer one
+ * has been queued are dropped as late, gaps are counted as lost.
+ */
+void audio_jitter_push(struct audio_jitter* jb, uint32_t sequence, uint32_t timestamp,
+                       uint32_t arrival_ms, const int16_t* samples, size_t frames) {
+    if (jb->started) {
+        int32_t gap = (int32_t)(sequence - jb->next_sequence);
+        if (gap < -AUDIO_JITTER_RESYNC || gap > AUDIO_JITTER_RESYNC || (sequence == 0 && gap < 0)) {
+            jb->started = false;
+        } else if (gap < 0) {
+            jb->stats.late++;
+            return;
+        } else {
+            jb->stats.lost += gap;
+            // RFC 3550 interarrival jitter, kept in 1/16 ms
+            int32_t sent = (int64_t)(int32_t)(timestamp - jb->last_timestamp) * 1000 / jb->sample_rate;
+            int32_t d = (int32_t)(arrival_ms - jb->last_arrival_ms) - sent;
+            if (d < 0)
+                d = -d;
+            jb->jitter_q4 += d - ((jb->jitter_q4 + 8) >> 4);
+        }
+    }
+    jb->started = true;
+    jb->next_sequence = sequence + 1;
+    jb->last_timestamp = timestamp;
+    jb->last_arrival_ms = arrival_ms;
+    jitter_retarget(jb);
+
+    if (jb->count + frames > jb->capacity) {
+        jitter_drop(jb, jb->count + frames - jb->capacity);
+        jb->stats.overruns++;
+    }
+
+    uint32_t write_pos = (jb->read_pos + jb->count) % jb->capacity;
+    uint32_t first = jb->capacity - write_pos;
+    if (first > frames)
+        first = frames;
+    memcpy(jb->ring + write_pos * jb->channels, samples, first * jb->channels * sizeof(int16_t));
+    memcpy(jb->ring, samples + first * jb->channels, (frames - first) * jb->channels * sizeof(int16_t));
+    jb->count += frames;
+
+    // Trim back to the target when latency has built up well past it
+    uint32_t high_ms = jb->target_ms + jb->target_ms / 2 + AUDIO_JITTER_STEP_MS;
+    if (jb->primed && frames_to_ms(jb->count, jb->sample_rate) > high_ms) {
+        jitter_drop(jb, jb->count - ms_to_frames(jb->target_ms, jb->sample_rate));
+        jb->stats.overruns++;
+    }
+}
+
+/*
+ * Fills *out* with *frames* frames, padding with silence while the buffer
+ * is priming or has run dry. Returns the number of real frames copied.
+ */
+size_t audio_jitter_read(struct audio_jitter* jb, int16_t* out, size_t frames) {
+    size_t copied = 0;
+
+    if (!jb->primed && frames_to_ms(jb->count, jb->sample_rate) >= jb->target_ms)
+        jb->primed = true;
+
+    if (jb->primed) {
+        copied = frames < jb->count ? frames : jb->count;
+        uint32_t first = jb->capacity - jb->read_pos;
+        if (first > copied)
+            first = copied;
+        memcpy(out, jb->ring + jb->read_pos * jb->channels, first * jb->channels * sizeof(int16_t));
+        memcpy(out + first * jb->channels, jb->ring, (copied - first) * jb->channels * sizeof(int16_t));
+        jitter_drop(jb, copied);
+
+        if (copied < frames) {
+            jb->primed = false;
+            jitter_underrun(jb);
+        } else {
+            jb->stable_frames += copied;
+            if (jb->stable_frames >= ms_to_frames(AUDIO_JITTER_DECAY_MS, jb->sample_rate)) {
+                jb->stable_frames = 0;
+                if (jb->base_ms >= jb->min_ms + AUDIO_JITTER_STEP_MS)
+                    jb->base_ms -= AUDIO_JITTER_STEP_MS;
+                jitter_retarget(jb);
+            }
+        }
+    }
+
+    memset(out + copied * jb->channels, 0, (frames - copied) * jb->channels * sizeof(int16_t));
+    return copied;
+}
+
+/*
+ * Records a gap played by the device because audio wasn't handed to it in
+ * time. The ring still holds the audio, so only the target is raised.
+ */
+void audio_jitter_device_underrun(struct audio_jitter* jb) {
+    jitter_underrun(jb);
+}
+
+void audio_jitter_get_stats(const struct audio_jitter* jb, struct audio_stats* stats) {
+    *stats = jb->stats;
+    stats->buffered_ms = frames_to_ms(jb->count, jb->sample_rate);
+    stats->target_ms   = jb->target_ms;
+    stats->jitter_ms   = jb->jitter_q4 >> 4;
+}
+
+// Monotonic milliseconds; osGetTime() follows the user-settable clock
+uint32_t audio_time_ms() {
+#ifdef _3DS
+    return (uint32_t)(svcGetSystemTick() / (SYSCLOCK_ARM11 / 1000));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+static void stream_stop() {
+    audio_failed = false;
+    if (audio_active) {
+        audio_active = false;
+        audio_output->close(audio_output);
+        audio_jitter_free(&audio_jb);
+    }
+}
+
+static void stream_update(uint32_t now_ms) {
+    size_t frames;
+    if (!audio_active)
+        return;
+    while ((frames = audio_output->writable(audio_output, now_ms)) > 0) {
+        if (frames > AUDIO_MAX_PACKET_FRAMES)
+            frames = AUDIO_MAX_PACKET_FRAMES;
+        audio_jitter_read(&audio_jb, audio_samples, frames);
+        audio_output->write(audio_output, audio_samples, frames);
+    }
+    for (; audio_sink_underruns != audio_output->underruns; ++audio_sink_underruns)
+        audio_jitter_device_underrun(&audio_jb);
+}
+
+static int stream_receive(const struct audio_packet* packet, uint32_t arrival_ms) {
+    if (!audio_output || audio_failed)
+        return -1;
+
+    if (!audio_active || audio_jb.sample_rate != packet->sample_rate || audio_jb.channels != packet->channels) {
+        stream_stop();
+        if (audio_jitter_init(&audio_jb, packet->sample_rate, packet->channels,
+                AUDIO_JITTER_MIN_MS, AUDIO_JITTER_MAX_MS) != 0) {
+            printf("Audio buffer allocation failed.\n");
+            return -1;
+        }
+        if (audio_output->open(audio_output, packet->sample_rate, packet->channels) != 0) {
+            printf("Audio %s sink failed to open.\n", audio_output->name);
+            audio_jitter_free(&audio_jb);
+            audio_failed = true;
+            return -1;
+        }
+        audio_active = true;
+        audio_sink_underruns = audio_output->underruns;
+        printf("Audio stream started (%luHz, %u ch).\n", (unsigned long)packet->sample_rate, packet->channels);
+    }
+
+    audio_packet_decode(packet, audio_samples);
+    audio_jitter_push(&audio_jb, packet->sequence, packet->timestamp, arrival_ms, audio_samples, packet->frames);
+    return 0;
+}
+
+#ifdef _3DS
+static void audio_feeder_main(void* arg) {
+    (void)arg;
+    while (audio_feeding) {
+        LightEvent_Wait(&audio_wake);
+        audio_stream_update(audio_time_ms());
+    }
+}
+
+// Called from the sink when the device has consumed audio
+void audio_stream_wake() {
+    LightEvent_Signal(&audio_wake);
+}
+#endif
+
+/*
+ * Selects the sink used for playback. *sink* may be NULL, in which case
+ * audio packets are rejected.
+ */
+void audio_stream_init(struct audio_sink* sink) {
+    if (!audio_initialized) {
+#ifdef _3DS
+        s32 priority;
+        LightLock_Init(&audio_mutex);
+        LightEvent_Init(&audio_wake, RESET_ONESHOT);
+        svcGetThreadPriority(&priority, CUR_THREAD_HANDLE);
+        audio_feeding = true;
+        // Run above the main thread so a busy main loop can't starve the DSP
+        audio_feeder = threadCreate(audio_feeder_main, NULL, 0x4000, priority - 1, -2, false);
+        if (!audio_feeder) {
+            audio_feeding = false;
+            printf("Audio feeder thread failed to start, audio disabled.\n");
+        }
+#endif
+        audio_initialized = true;
+    }
+
+#ifdef _3DS
+    // Without the feeder nothing would ever hand audio to the sink
+    if (!audio_feeding)
+        sink = NULL;
+#endif
+
+    audio_lock();
+    stream_stop();
+    audio_output = sink;
+    audio_unlock();
+}
+
+// Close the sink and drop any buffered audio until the next packet arrives
+void audio_stream_stop() {
+    if (!audio_initialized)
+        return;
+    audio_lock();
+    stream_stop();
+    audio_unlock();
+}
+
+/*
+ * Handles one binary audio message. The sink is (re)opened whenever the
+ * sample rate or channel count changes. Returns 0 on success, -1 if the
+ * message is malformed or playback could not be started.
+ */
+int audio_stream_receive(const uint8_t* data, size_t size, uint32_t arrival_ms) {
+    struct audio_packet packet;
+    int r;
+    if (!audio_initialized || audio_packet_parse(&packet, data, size) != 0)
+        return -1;
+    audio_lock();
+    r = stream_receive(&packet, arrival_ms);
+    audio_unlock();
+    return r;
+}
+
+/*
+ * Move as much buffered audio to the sink as it will currently accept.
+ * The console's feeder thread calls this on its own; on the host it has to
+ * be called regularly by the driver.
+ */
+void audio_stream_update(uint32_t now_ms) {
+    if (!audio_initialized)
+        return;
+    audio_lock();
+    stream_update(now_ms);
+    audio_unlock();
+}
+
+void audio_stream_get_stats(struct audio_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!audio_initialized)
+        return;
+    audio_lock();
+    if (audio_active)
+        audio_jitter_get_stats(&audio_jb, stats);
+    audio_unlock();
+}
+
+void audio_stream_exit() {
+    if (!audio_initialized)
+        return;
+#ifdef _3DS
+    if (audio_feeder) {
+        audio_feeding = false;
+        LightEvent_Signal(&audio_wake);
+        threadJoin(audio_feeder, U64_MAX);
+        threadFree(audio_feeder);
+        audio_feeder = NULL;
+    }
+#endif
+    stream_stop();
+    audio_output = NULL;
+    audio_initialized = false;
+}
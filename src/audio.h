@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Audio packets are sent by the client as binary websocket messages.
+ * Every packet starts with a fixed 24 byte little-endian header:
+ *
+ *   0  char[4]  magic "WSAU"
+ *   4  u8       version (AUDIO_PACKET_VERSION)
+ *   5  u8       codec (AUDIO_CODEC_*)
+ *   6  u8       channels (1 or 2)
+ *   7  u8       reserved
+ *   8  u32      sequence number, +1 per packet
+ *  12  u32      timestamp of the first frame, in frames at sample_rate
+ *  16  u32      sample rate in Hz
+ *  20  u16      number of frames in the packet
+ *  22  u16      reserved
+ *
+ * PCM16 payloads are interleaved signed 16-bit samples.
+ *
+ * IMA ADPCM payloads start with 4 bytes of decoder state per channel
+ * (s16 predictor, u8 step index, u8 reserved) followed by 4-bit codes for
+ * the interleaved samples, low nibble first. The state only seeds the
+ * decoder so every packet can be decoded on its own.
+ */
+#define AUDIO_PACKET_MAGIC "WSAU"
+#define AUDIO_PACKET_VERSION 1
+#define AUDIO_PACKET_HEADER_SIZE 24
+#define AUDIO_MAX_CHANNELS 2
+#define AUDIO_MAX_PACKET_FRAMES 4096
+
+enum audio_codec {
+    AUDIO_CODEC_PCM16 = 0,
+    AUDIO_CODEC_ADPCM = 1,
+};
+
+struct audio_packet {
+    uint8_t codec;
+    uint8_t channels;
+    uint32_t sequence;
+    uint32_t timestamp;
+    uint32_t sample_rate;
+    uint16_t frames;
+    const uint8_t* payload;
+    size_t payload_size;
+};
+
+// Counters reported to the client, all times in milliseconds
+struct audio_stats {
+    uint32_t underruns;
+    uint32_t overruns;
+    uint32_t lost;
+    uint32_t late;
+    uint32_t buffered_ms;
+    uint32_t target_ms;
+    uint32_t jitter_ms;
+};
+
+/*
+ * Playback device. *writable* returns how many frames the device can take
+ * right now and *write* is only ever called with at most that many.
+ * *underruns* is bumped by the sink whenever the device itself ran out of
+ * queued audio and played a gap.
+ */
+struct audio_sink {
+    const char* name;
+    int (*open)(struct audio_sink* sink, uint32_t sample_rate, uint8_t channels);
+    size_t (*writable)(struct audio_sink* sink, uint32_t now_ms);
+    void (*write)(struct audio_sink* sink, const int16_t* samples, size_t frames);
+    void (*close)(struct audio_sink* sink);
+    void* data;
+    uint32_t underruns;
+};
+
+struct audio_sink* audio_sink_null();
+struct audio_sink* audio_sink_file(const char* path);
+#ifdef _3DS
+struct audio_sink* audio_sink_ndsp();
+#endif
+
+/*
+ * Adaptive jitter buffer. Playback waits until *target_ms* of audio is
+ * buffered. Every underrun raises the target by a step, and a long enough
+ * stretch without one lowers it again. The target never drops below twice
+ * the measured arrival jitter. Audio piling up well past the target is
+ * dropped and counted as an overrun to keep latency bounded.
+ */
+struct audio_jitter {
+    int16_t* ring;
+    uint32_t capacity;
+    uint32_t read_pos;
+    uint32_t count;
+    uint32_t sample_rate;
+    uint8_t channels;
+
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t base_ms;
+    uint32_t target_ms;
+    uint32_t stable_frames;
+    bool primed;
+
+    bool started;
+    uint32_t next_sequence;
+    uint32_t last_timestamp;
+    uint32_t last_arrival_ms;
+    uint32_t jitter_q4;
+
+    struct audio_stats stats;
+};
+
+int audio_packet_parse(struct audio_packet* packet, const uint8_t* data, size_t size);
+int audio_packet_decode(const struct audio_packet* packet, int16_t* out);
+
+int audio_jitter_init(struct audio_jitter* jb, uint32_t sample_rate, uint8_t channels,
+                      uint32_t min_ms, uint32_t max_ms);
+void audio_jitter_free(struct audio_jitter* jb);
+void audio_jitter_push(struct audio_jitter* jb, uint32_t sequence, uint32_t timestamp,
+                       uint32_t arrival_ms, const int16_t* samples, size_t frames);
+size_t audio_jitter_read(struct audio_jitter* jb, int16_t* out, size_t frames);
+void audio_jitter_device_underrun(struct audio_jitter* jb);
+void audio_jitter_get_stats(const struct audio_jitter* jb, struct audio_stats* stats);
+
+uint32_t audio_time_ms();
+
+void audio_stream_init(struct audio_sink* sink);
+int audio_stream_receive(const uint8_t* data, size_t size, uint32_t arrival_ms);
+void audio_stream_update(uint32_t now_ms);
+void audio_stream_get_stats(struct audio_stats* stats);
+void audio_stream_stop();
+void audio_stream_exit();
+#ifdef _3DS
+void audio_stream_wake();
+#endif
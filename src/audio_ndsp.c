@@ -0,0 +1,114 @@
+#ifdef _3DS
+
+#include <stdio.h>
+#include <string.h>
+
+#include <3ds.h>
+#include "audio.h"
+
+#define NDSP_SINK_CHANNEL 0
+#define NDSP_SINK_BUFFERS 4
+// Each wave buffer holds 10ms, so the DSP queue adds at most 40ms of latency.
+// The feeder thread refills it from the ~5ms DSP frame callback.
+#define NDSP_SINK_BUFFER_MS 10
+
+static ndspWaveBuf ndsp_bufs[NDSP_SINK_BUFFERS];
+static int16_t* ndsp_pcm;
+static size_t ndsp_buffer_frames;
+static uint8_t ndsp_channels;
+static int ndsp_next;
+// Set once audio is queued, so the initially empty queue isn't a starvation
+static bool ndsp_playing;
+
+static void ndsp_frame_callback(void* arg) {
+    (void)arg;
+    audio_stream_wake();
+}
+
+static int ndsp_open(struct audio_sink* sink, uint32_t sample_rate, uint8_t channels) {
+    float mix[12];
+    int i;
+    (void)sink;
+
+    ndsp_channels = channels;
+    ndsp_buffer_frames = sample_rate * NDSP_SINK_BUFFER_MS / 1000;
+    ndsp_pcm = linearAlloc(NDSP_SINK_BUFFERS * ndsp_buffer_frames * channels * sizeof(int16_t));
+    if (!ndsp_pcm)
+        return -1;
+
+    ndspSetOutputMode(NDSP_OUTPUT_STEREO);
+    ndspChnReset(NDSP_SINK_CHANNEL);
+    ndspChnSetInterp(NDSP_SINK_CHANNEL, NDSP_INTERP_LINEAR);
+    ndspChnSetRate(NDSP_SINK_CHANNEL, sample_rate);
+    ndspChnSetFormat(NDSP_SINK_CHANNEL, channels == 2 ? NDSP_FORMAT_STEREO_PCM16 : NDSP_FORMAT_MONO_PCM16);
+    memset(mix, 0, sizeof(mix));
+    mix[0] = mix[1] = 1.0f;
+    ndspChnSetMix(NDSP_SINK_CHANNEL, mix);
+
+    memset(ndsp_bufs, 0, sizeof(ndsp_bufs));
+    for (i = 0; i < NDSP_SINK_BUFFERS; ++i) {
+        ndsp_bufs[i].data_pcm16 = ndsp_pcm + i * ndsp_buffer_frames * channels;
+        ndsp_bufs[i].status = NDSP_WBUF_DONE;
+    }
+    ndsp_next = 0;
+    ndsp_playing = false;
+    ndspSetCallback(ndsp_frame_callback, NULL);
+    return 0;
+}
+
+// The next wave buffer in queue order is the only one that can be refilled
+static size_t ndsp_writable(struct audio_sink* sink, uint32_t now_ms) {
+    int i;
+    u8 status = ndsp_bufs[ndsp_next].status;
+    (void)now_ms;
+
+    // Every buffer already played means the DSP ran dry before this refill
+    if (ndsp_playing) {
+        for (i = 0; i < NDSP_SINK_BUFFERS && ndsp_bufs[i].status == NDSP_WBUF_DONE; ++i);
+        if (i == NDSP_SINK_BUFFERS) {
+            sink->underruns++;
+            ndsp_playing = false;
+        }
+    }
+
+    return (status == NDSP_WBUF_FREE || status == NDSP_WBUF_DONE) ? ndsp_buffer_frames : 0;
+}
+
+static void ndsp_write(struct audio_sink* sink, const int16_t* samples, size_t frames) {
+    ndspWaveBuf* buf = &ndsp_bufs[ndsp_next];
+    size_t size = frames * ndsp_channels * sizeof(int16_t);
+    (void)sink;
+    memcpy(buf->data_pcm16, samples, size);
+    buf->nsamples = frames;
+    DSP_FlushDataCache(buf->data_pcm16, size);
+    ndspChnWaveBufAdd(NDSP_SINK_CHANNEL, buf);
+    ndsp_next = (ndsp_next + 1) % NDSP_SINK_BUFFERS;
+    ndsp_playing = true;
+}
+
+static void ndsp_close(struct audio_sink* sink) {
+    (void)sink;
+    ndspSetCallback(NULL, NULL);
+    ndspChnWaveBufClear(NDSP_SINK_CHANNEL);
+    if (ndsp_pcm) {
+        linearFree(ndsp_pcm);
+        ndsp_pcm = NULL;
+    }
+}
+
+static struct audio_sink ndsp_sink = {
+    "ndsp",
+    ndsp_open,
+    ndsp_writable,
+    ndsp_write,
+    ndsp_close,
+    NULL,
+    0
+};
+
+// ndspInit() must have succeeded before the sink is opened
+struct audio_sink* audio_sink_ndsp() {
+    return &ndsp_sink;
+}
+
+#endif // _3DS
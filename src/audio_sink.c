@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "audio.h"
+
+/*
+ * The null and file sinks consume audio in real time against *now_ms*, as
+ * a sound device would, so the jitter buffer behaves the same as on the
+ * console. Feeding them simulated timestamps makes runs reproducible.
+ */
+struct paced_sink {
+    uint32_t sample_rate;
+    uint8_t channels;
+    bool started;
+    uint32_t start_ms;
+    uint64_t written;
+    FILE* file;
+    const char* path;
+};
+
+// Device-side buffering in ms, mirroring the ndsp sink's wave buffers
+#define PACED_SINK_LEAD_MS 40
+
+static struct paced_sink null_data;
+static struct paced_sink file_data;
+
+static int paced_open(struct audio_sink* sink, uint32_t sample_rate, uint8_t channels) {
+    struct paced_sink* s = sink->data;
+    s->sample_rate = sample_rate;
+    s->channels = channels;
+    s->started = false;
+    s->written = 0;
+    return 0;
+}
+
+static size_t paced_writable(struct audio_sink* sink, uint32_t now_ms) {
+    struct paced_sink* s = sink->data;
+    if (!s->started) {
+        s->started = true;
+        s->start_ms = now_ms;
+    }
+    uint64_t lead = (uint64_t)PACED_SINK_LEAD_MS * s->sample_rate / 1000;
+    uint64_t due = (uint64_t)(uint32_t)(now_ms - s->start_ms) * s->sample_rate / 1000 + lead;
+    // The device drained its lead: play the gap out as silence, so the
+    // file sink's output keeps the same length as the time that passed
+    if (s->written > 0 && due > s->written + lead) {
+        static const int16_t silence[256 * AUDIO_MAX_CHANNELS];
+        uint64_t gap = due - lead - s->written;
+        sink->underruns++;
+        while (gap > 0) {
+            size_t frames = gap < 256 ? gap : 256;
+            sink->write(sink, silence, frames);
+            gap -= frames;
+        }
+    }
+    return due > s->written ? due - s->written : 0;
+}
+
+static void null_write(struct audio_sink* sink, const int16_t* samples, size_t frames) {
+    struct paced_sink* s = sink->data;
+    (void)samples;
+    s->written += frames;
+}
+
+static void null_close(struct audio_sink* sink) {
+    (void)sink;
+}
+
+static struct audio_sink null_sink = {
+    "null",
+    paced_open,
+    paced_writable,
+    null_write,
+    null_close,
+    &null_data,
+    0
+};
+
+struct audio_sink* audio_sink_null() {
+    return &null_sink;
+}
+
+static void write_u16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void write_u32(uint8_t* p, uint32_t v) {
+    write_u16(p, v & 0xFFFF);
+    write_u16(p + 2, v >> 16);
+}
+
+// Canonical 44 byte WAV header for PCM16 data of *data_size* bytes
+static void wav_header(uint8_t* h, uint32_t sample_rate, uint8_t channels, uint32_t data_size) {
+    memcpy(h, "RIFF", 4);
+    write_u32(h + 4, 36 + data_size);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    write_u32(h + 16, 16);
+    write_u16(h + 20, 1);
+    write_u16(h + 22, channels);
+    write_u32(h + 24, sample_rate);
+    write_u32(h + 28, sample_rate * channels * 2);
+    write_u16(h + 32, channels * 2);
+    write_u16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    write_u32(h + 40, data_size);
+}
+
+static int file_open(struct audio_sink* sink, uint32_t sample_rate, uint8_t channels) {
+    struct paced_sink* s = sink->data;
+    uint8_t header[44];
+    paced_open(sink, sample_rate, channels);
+    if (!(s->file = fopen(s->path, "wb"))) {
+        perror("fopen");
+        return -1;
+    }
+    // Sizes are filled in on close
+    wav_header(header, sample_rate, channels, 0);
+    fwrite(header, 1, sizeof(header), s->file);
+    return 0;
+}
+
+static void file_write(struct audio_sink* sink, const int16_t* samples, size_t frames) {
+    struct paced_sink* s = sink->data;
+    size_t i, count = frames * s->channels;
+    uint8_t buf[256];
+    for (i = 0; i < count; ++i) {
+        write_u16(buf + (i % 128) * 2, samples[i]);
+        if (i % 128 == 127 || i == count - 1)
+            fwrite(buf, 2, i % 128 + 1, s->file);
+    }
+    s->written += frames;
+}
+
+static void file_close(struct audio_sink* sink) {
+    struct paced_sink* s = sink->data;
+    uint8_t header[44];
+    if (!s->file)
+        return;
+    wav_header(header, s->sample_rate, s->channels, s->written * s->channels * 2);
+    fseek(s->file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), s->file);
+    fclose(s->file);
+    s->file = NULL;
+}
+
+static struct audio_sink file_sink = {
+    "file",
+    file_open,
+    paced_writable,
+    file_write,
+    file_close,
+    &file_data,
+    0
+};
+
+/*
+ * Writes the played audio, including silence inserted on underruns, to a
+ * WAV file at *path*. The file is rewritten each time the stream restarts.
+ */
+struct audio_sink* audio_sink_file(const char* path) {
+    file_data.path = path;
+    return &file_sink;
+}
@@ -9,6 +9,7 @@
 #include <jansson.h>
 #include <nettle/base64.h>
 #include "ws3ds.h"
+#include "audio.h"
 #include "util.h"
 
 #define VERSION "1.0"
@@ -16,6 +17,7 @@
 #define SOC_BUFFERSIZE 0x100000
 
 static u32* socBuffer;
+static bool ndspInitialized = false;
 
 bool service_init() {
     gfxInit(GSP_RGBA8_OES, GSP_BGR8_OES, false);
@@ -23,12 +25,20 @@ bool service_init() {
     consoleInit(GFX_BOTTOM, NULL);
     amInit();
     cfguInit();
+    // Fails when dspfirm.cdc has not been dumped to the SD card
+    ndspInitialized = R_SUCCEEDED(ndspInit());
+    if (!ndspInitialized)
+        printf("DSP init failed, audio disabled.\n");
+    audio_stream_init(ndspInitialized ? audio_sink_ndsp() : NULL);
     socBuffer = (u32*)memalign(0x1000, SOC_BUFFERSIZE);
     return R_SUCCEEDED(socInit(socBuffer, SOC_BUFFERSIZE));
 }
 
 void service_exit() {
     ws3ds_exit();
+    audio_stream_exit();
+    if (ndspInitialized)
+        ndspExit();
     socExit();
     cfguExit();
     amExit();
@@ -84,11 +94,33 @@ void send_app_list() {
     free(titleIds);
 }
 
+// Send jitter buffer counters as a JSON object
+void send_audio_stats() {
+    struct audio_stats stats;
+    audio_stream_get_stats(&stats);
+
+    json_t *root = json_pack("{s:I, s:I, s:I, s:I, s:I, s:I, s:I}",
+        "underruns", (json_int_t)stats.underruns,
+        "overruns", (json_int_t)stats.overruns,
+        "lost", (json_int_t)stats.lost,
+        "late", (json_int_t)stats.late,
+        "buffered_ms", (json_int_t)stats.buffered_ms,
+        "target_ms", (json_int_t)stats.target_ms,
+        "jitter_ms", (json_int_t)stats.jitter_ms);
+
+    char* outstr = json_dumps(root, 0);
+    ws3ds_send_text(outstr);
+    free(outstr);
+    json_decref(root);
+}
+
 void on_message(const struct wslay_event_on_msg_recv_arg *arg) {
     if (arg->opcode == 1) { // Text type
         // Note: msg is not NULL terminated
         if (arg->msg_length == 8 && strncmp("LISTAPPS", arg->msg, 8) == 0)
             send_app_list();
+        else if (arg->msg_length == 10 && strncmp("AUDIOSTATS", arg->msg, 10) == 0)
+            send_audio_stats();
         else
             printf("Text received: %.*s\n", arg->msg_length, arg->msg);
     } else if (arg->opcode == 2) { // Binary type
@@ -98,6 +130,8 @@ void on_message(const struct wslay_event_on_msg_recv_arg *arg) {
             // Copy pixels directly to framebuffer
             u8* dst = gfxGetFramebuffer(GFX_TOP, GFX_LEFT, NULL, NULL);
             memcpy(dst, arg->msg, size);
+        } else {
+            audio_stream_receive(arg->msg, arg->msg_length, audio_time_ms());
         }
     }
 }
@@ -165,6 +199,7 @@ int main(int argc, char **argv)
                 connected = false;
                 close(socket_client);
                 socket_client = -1;
+                audio_stream_stop();
             }
         }
     }
@@ -0,0 +1,379 @@
+/*
+ * Host-side checks for the audio packet decoder and jitter buffer.
+ * Everything runs against simulated timestamps, so results are exact.
+ *
+ *   ./audio_test         run the checks
+ *   ./audio_test bench   time ADPCM decoding and buffer throughput
+ */
+
+// clock_gettime() for the benchmark under -std=c99
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+#define RATE 8000
+#define PACKET_FRAMES 160 // 20ms at RATE
+#define PACKET_MS 20
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+static void put_header(uint8_t* p, uint8_t codec, uint8_t channels, uint32_t sequence,
+                       uint32_t timestamp, uint32_t sample_rate, uint16_t frames) {
+    memset(p, 0, AUDIO_PACKET_HEADER_SIZE);
+    memcpy(p, AUDIO_PACKET_MAGIC, 4);
+    p[4] = AUDIO_PACKET_VERSION;
+    p[5] = codec;
+    p[6] = channels;
+    put_u32(p + 8, sequence);
+    put_u32(p + 12, timestamp);
+    put_u32(p + 16, sample_rate);
+    put_u16(p + 20, frames);
+}
+
+// Mono PCM16 packet of PACKET_FRAMES frames, returns its size
+static size_t make_pcm_packet(uint8_t* p, uint32_t sequence) {
+    int i;
+    put_header(p, AUDIO_CODEC_PCM16, 1, sequence, sequence * PACKET_FRAMES, RATE, PACKET_FRAMES);
+    for (i = 0; i < PACKET_FRAMES; ++i)
+        put_u16(p + AUDIO_PACKET_HEADER_SIZE + i * 2, (i % 16 < 8) ? 1000 : -1000);
+    return AUDIO_PACKET_HEADER_SIZE + PACKET_FRAMES * 2;
+}
+
+static void test_parse() {
+    uint8_t p[AUDIO_PACKET_HEADER_SIZE + PACKET_FRAMES * 2];
+    struct audio_packet packet;
+    size_t size = make_pcm_packet(p, 0);
+
+    CHECK(audio_packet_parse(&packet, p, size) == 0);
+    CHECK(packet.frames == PACKET_FRAMES && packet.sample_rate == RATE && packet.channels == 1);
+    CHECK(audio_packet_parse(&packet, p, size - 1) == -1);
+    CHECK(audio_packet_parse(&packet, p, AUDIO_PACKET_HEADER_SIZE - 1) == -1);
+
+    p[4] = AUDIO_PACKET_VERSION + 1;
+    CHECK(audio_packet_parse(&packet, p, size) == -1);
+    p[4] = AUDIO_PACKET_VERSION;
+    p[6] = 3;
+    CHECK(audio_packet_parse(&packet, p, size) == -1);
+    p[6] = 1;
+    p[5] = 7;
+    CHECK(audio_packet_parse(&packet, p, size) == -1);
+    p[5] = AUDIO_CODEC_PCM16;
+    p[0] = 'X';
+    CHECK(audio_packet_parse(&packet, p, size) == -1);
+}
+
+static void test_adpcm() {
+    uint8_t p[AUDIO_PACKET_HEADER_SIZE + 8 + 2];
+    struct audio_packet packet;
+    int16_t out[4];
+
+    // Mono from silence: codes 7, 7, F, 0 worked through the IMA tables by hand
+    put_header(p, AUDIO_CODEC_ADPCM, 1, 0, 0, RATE, 4);
+    memset(p + AUDIO_PACKET_HEADER_SIZE, 0, 4);
+    p[AUDIO_PACKET_HEADER_SIZE + 4] = 0x77;
+    p[AUDIO_PACKET_HEADER_SIZE + 5] = 0x0F;
+    CHECK(audio_packet_parse(&packet, p, AUDIO_PACKET_HEADER_SIZE + 6) == 0);
+    CHECK(audio_packet_decode(&packet, out) == 0);
+    CHECK(out[0] == 11 && out[1] == 41 && out[2] == -22 && out[3] == -13);
+
+    // Output clamps at full scale
+    put_header(p, AUDIO_CODEC_ADPCM, 1, 0, 0, RATE, 1);
+    put_u16(p + AUDIO_PACKET_HEADER_SIZE, 32760);
+    p[AUDIO_PACKET_HEADER_SIZE + 2] = 88;
+    p[AUDIO_PACKET_HEADER_SIZE + 4] = 0x07;
+    CHECK(audio_packet_parse(&packet, p, AUDIO_PACKET_HEADER_SIZE + 5) == 0);
+    audio_packet_decode(&packet, out);
+    CHECK(out[0] == 32767);
+
+    // Stereo keeps a separate state per channel, nibbles alternate L/R
+    put_header(p, AUDIO_CODEC_ADPCM, 2, 0, 0, RATE, 1);
+    memset(p + AUDIO_PACKET_HEADER_SIZE, 0, 8);
+    put_u16(p + AUDIO_PACKET_HEADER_SIZE, 100);
+    put_u16(p + AUDIO_PACKET_HEADER_SIZE + 4, (uint16_t)-100);
+    p[AUDIO_PACKET_HEADER_SIZE + 8] = 0xC4;
+    CHECK(audio_packet_parse(&packet, p, AUDIO_PACKET_HEADER_SIZE + 9) == 0);
+    audio_packet_decode(&packet, out);
+    CHECK(out[0] == 107 && out[1] == -107);
+
+    // Truncated payload is rejected
+    CHECK(audio_packet_parse(&packet, p, AUDIO_PACKET_HEADER_SIZE + 8) == -1);
+}
+
+/*
+ * Plays *ms* milliseconds through *jb*, reading 10ms every 10ms. Packets
+ * are sent every 20ms starting at *sequence* and arrive *delay(i)* ms late.
+ * Returns the next sequence number.
+ */
+static uint32_t simulate(struct audio_jitter* jb, uint32_t start_ms, uint32_t ms,
+                         uint32_t sequence, uint32_t (*delay)(uint32_t)) {
+    static int16_t samples[PACKET_FRAMES], out[PACKET_FRAMES];
+    uint32_t now, sent = 0, arrived = 0, pending[64];
+    int i;
+
+    for (i = 0; i < PACKET_FRAMES; ++i)
+        samples[i] = 1000;
+    for (now = start_ms; now < start_ms + ms; ++now) {
+        if ((now - start_ms) % PACKET_MS == 0 && sent - arrived < 64) {
+            pending[sent % 64] = now + (delay ? delay(sent) : 0);
+            sent++;
+        }
+        // Arrivals are delivered in send order, like a TCP stream
+        while (arrived < sent && pending[arrived % 64] <= now) {
+            audio_jitter_push(jb, sequence, sequence * PACKET_FRAMES, now, samples, PACKET_FRAMES);
+            sequence++;
+            arrived++;
+        }
+        if ((now - start_ms) % 10 == 0)
+            audio_jitter_read(jb, out, RATE / 100);
+    }
+    return sequence;
+}
+
+// Reads only, as if the sender had stalled
+static void stall(struct audio_jitter* jb, uint32_t ms) {
+    static int16_t out[PACKET_FRAMES];
+    uint32_t t;
+    for (t = 0; t < ms; t += 10)
+        audio_jitter_read(jb, out, RATE / 100);
+}
+
+static uint32_t alternating_delay(uint32_t i) {
+    return (i & 1) ? 30 : 0;
+}
+
+static void push_one(struct audio_jitter* jb, uint32_t sequence, uint32_t now) {
+    static int16_t samples[PACKET_FRAMES];
+    audio_jitter_push(jb, sequence, sequence * PACKET_FRAMES, now, samples, PACKET_FRAMES);
+}
+
+static void test_jitter_steady() {
+    struct audio_jitter jb;
+    struct audio_stats stats;
+
+    CHECK(audio_jitter_init(&jb, RATE, 1, 40, 400) == 0);
+    simulate(&jb, 0, 10000, 0, NULL);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.underruns == 0 && stats.overruns == 0);
+    CHECK(stats.lost == 0 && stats.late == 0 && stats.jitter_ms == 0);
+    CHECK(stats.target_ms == 40);
+    CHECK(stats.buffered_ms <= stats.target_ms + PACKET_MS);
+    audio_jitter_free(&jb);
+}
+
+static void test_jitter_sequence() {
+    struct audio_jitter jb;
+    struct audio_stats stats;
+
+    CHECK(audio_jitter_init(&jb, RATE, 1, 40, 400) == 0);
+    push_one(&jb, 0, 0);
+    push_one(&jb, 1, 20);
+    push_one(&jb, 4, 80);   // 2 and 3 lost
+    push_one(&jb, 3, 81);   // ... then 3 turns up late
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.lost == 2 && stats.late == 1);
+
+    // A restarted stream resyncs instead of counting a huge loss
+    push_one(&jb, 100000, 100);
+    push_one(&jb, 100001, 120);
+    push_one(&jb, 5, 140);
+    push_one(&jb, 6, 160);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.lost == 2 && stats.late == 1);
+
+    // So does a sender restarting at 0 after only a few packets
+    push_one(&jb, 0, 180);
+    push_one(&jb, 1, 200);
+    push_one(&jb, 2, 220);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.lost == 2 && stats.late == 1);
+    CHECK(jb.next_sequence == 3);
+    audio_jitter_free(&jb);
+}
+
+static void test_jitter_adapt() {
+    struct audio_jitter jb;
+    struct audio_stats stats;
+    uint32_t sequence, raised;
+
+    CHECK(audio_jitter_init(&jb, RATE, 1, 40, 400) == 0);
+    sequence = simulate(&jb, 0, 2000, 0, NULL);
+
+    // Sender stalls for 200ms: the buffer runs dry and the target goes up
+    stall(&jb, 200);
+    sequence = simulate(&jb, 2200, 1000, sequence, NULL);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.underruns >= 1);
+    CHECK(stats.target_ms > 60);
+    raised = stats.target_ms;
+
+    // Long stable playback brings it back down
+    sequence = simulate(&jb, 3200, 20000, sequence, NULL);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.target_ms < raised);
+
+    // Measured jitter keeps the target at least twice as large
+    simulate(&jb, 23200, 5000, sequence, alternating_delay);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.jitter_ms >= 10);
+    CHECK(stats.target_ms >= 2 * stats.jitter_ms);
+    audio_jitter_free(&jb);
+}
+
+static void test_jitter_overrun() {
+    struct audio_jitter jb;
+    struct audio_stats stats;
+    uint32_t i, sequence;
+
+    CHECK(audio_jitter_init(&jb, RATE, 1, 40, 400) == 0);
+    sequence = simulate(&jb, 0, 1000, 0, NULL);
+    // 600ms arrives in one burst
+    for (i = 0; i < 30; ++i)
+        push_one(&jb, sequence + i, 1000);
+    audio_jitter_get_stats(&jb, &stats);
+    CHECK(stats.overruns >= 1);
+    CHECK(stats.buffered_ms <= stats.target_ms + stats.target_ms / 2 + PACKET_MS);
+    audio_jitter_free(&jb);
+}
+
+static void test_stream_device_underrun() {
+    uint8_t p[AUDIO_PACKET_HEADER_SIZE + PACKET_FRAMES * 2];
+    struct audio_stats stats;
+    uint32_t now, sequence = 0;
+
+    audio_stream_init(audio_sink_null());
+    for (now = 0; now < 2000; ++now) {
+        if (now % PACKET_MS == 0)
+            CHECK(audio_stream_receive(p, make_pcm_packet(p, sequence++), now) == 0);
+        // Nothing feeds the sink between 1000 and 1200ms
+        if (now < 1000 || now >= 1200)
+            audio_stream_update(now);
+    }
+    audio_stream_get_stats(&stats);
+    CHECK(stats.underruns >= 1);
+    CHECK(stats.target_ms > 60);
+    audio_stream_exit();
+}
+
+static void test_stream_file_sink() {
+    const char* path = "audio_test.wav";
+    uint8_t p[AUDIO_PACKET_HEADER_SIZE + PACKET_FRAMES * 2], header[44];
+    struct audio_stats stats;
+    uint32_t now, sequence = 0;
+    long size;
+    FILE* f;
+
+    audio_stream_init(audio_sink_file(path));
+    for (now = 0; now < 1000; ++now) {
+        if (now % PACKET_MS == 0)
+            audio_stream_receive(p, make_pcm_packet(p, sequence++), now);
+        // Stall between 400 and 600ms so the sink plays a gap
+        if (now < 400 || now >= 600)
+            audio_stream_update(now);
+    }
+    audio_stream_get_stats(&stats);
+    CHECK(stats.underruns >= 1);
+    audio_stream_exit();
+
+    f = fopen(path, "rb");
+    CHECK(f != NULL);
+    if (!f)
+        return;
+    CHECK(fread(header, 1, sizeof(header), f) == sizeof(header));
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    remove(path);
+
+    CHECK(memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVE", 4) == 0);
+    CHECK((header[24] | header[25] << 8) == RATE);
+    CHECK((long)(header[4] | header[5] << 8 | header[6] << 16) == size - 8);
+    CHECK((long)(header[40] | header[41] << 8 | header[42] << 16) == size - 44);
+    // One second of mono PCM16 including the silent gap, plus the sink's lead
+    CHECK(size - 44 >= RATE * 2);
+}
+
+static double elapsed(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Decodes and buffers 60s of 48kHz stereo ADPCM in 20ms packets
+static void bench() {
+    static uint8_t p[AUDIO_PACKET_HEADER_SIZE + 8 + 960];
+    static int16_t samples[960 * 2];
+    struct audio_packet packet;
+    struct audio_jitter jb;
+    struct timespec start;
+    uint32_t i, packets = 3000;
+    double t;
+
+    put_header(p, AUDIO_CODEC_ADPCM, 2, 0, 0, 48000, 960);
+    for (i = 0; i < sizeof(p) - AUDIO_PACKET_HEADER_SIZE; ++i)
+        p[AUDIO_PACKET_HEADER_SIZE + i] = rand();
+    p[AUDIO_PACKET_HEADER_SIZE + 2] = p[AUDIO_PACKET_HEADER_SIZE + 6] = 20;
+    audio_packet_parse(&packet, p, sizeof(p));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < packets; ++i)
+        audio_packet_decode(&packet, samples);
+    t = elapsed(&start);
+    printf("adpcm decode: %.2f ms per 60s of audio (%.0fx realtime)\n", t * 1000, 60 / t);
+
+    audio_jitter_init(&jb, 48000, 2, 40, 400);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < packets; ++i) {
+        audio_jitter_push(&jb, i, i * 960, i * 20, samples, 960);
+        audio_jitter_read(&jb, samples, 480);
+        audio_jitter_read(&jb, samples, 480);
+    }
+    t = elapsed(&start);
+    printf("jitter push/read: %.2f ms per 60s of audio (%.0fx realtime)\n", t * 1000, 60 / t);
+    audio_jitter_free(&jb);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return EXIT_SUCCESS;
+    }
+
+    test_parse();
+    test_adpcm();
+    test_jitter_steady();
+    test_jitter_sequence();
+    test_jitter_adapt();
+    test_jitter_overrun();
+    test_stream_device_underrun();
+    test_stream_file_sink();
+
+    if (failures) {
+        printf("%d check(s) failed.\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All audio checks passed.\n");
+    return EXIT_SUCCESS;
+}